@@ -0,0 +1,60 @@
+# Compares the fast modes against the exact path on a synthetic mask of disks and speckle.
+# Run from this directory after building the module with setup.py.
+import argparse
+import time
+
+import numpy as np
+
+import tmaskcleaner
+
+
+def make_mask(width, height, disks, speckle, seed):
+    rng = np.random.default_rng(seed)
+    mask = np.zeros((height, width), np.uint8)
+    y, x = np.ogrid[:height, :width]
+    for _ in range(disks):
+        cx, cy, r = rng.integers(width), rng.integers(height), rng.integers(2, 14)
+        mask[(x - cx) ** 2 + (y - cy) ** 2 <= r * r] = 255
+    mask[rng.random((height, width)) < speckle] = 255
+    return mask
+
+
+def best_time(mask, runs, **kwargs):
+    best = float("inf")
+    for _ in range(runs):
+        start = time.perf_counter()
+        out = tmaskcleaner.clean(mask, threads=1, **kwargs)
+        best = min(best, time.perf_counter() - start)
+    return out, best * 1000
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("--width", type=int, default=1920)
+    parser.add_argument("--height", type=int, default=1080)
+    parser.add_argument("--disks", type=int, default=300)
+    parser.add_argument("--speckle", type=float, default=0.05, help="fraction of random pixels set")
+    parser.add_argument("--lengths", type=int, nargs="+", default=[5, 16, 50])
+    parser.add_argument("--runs", type=int, default=20)
+    parser.add_argument("--seed", type=int, default=1)
+    args = parser.parse_args()
+
+    mask = make_mask(args.width, args.height, args.disks, args.speckle, args.seed)
+    pixels = mask.size
+    print("%dx%d, %d disks, %.1f%% speckle, best of %d runs"
+          % (args.width, args.height, args.disks, args.speckle * 100, args.runs))
+    print("%6s %4s %9s %8s %9s %9s %6s" % ("length", "fast", "ms", "speedup", "removed", "differ", "lost"))
+    for length in args.lengths:
+        exact, exact_ms = best_time(mask, args.runs, length=length)
+        for fast in (0, 2, 4):
+            out, ms = (exact, exact_ms) if fast == 0 else best_time(mask, args.runs, length=length, fast=fast)
+            removed = np.count_nonzero(out != mask)
+            differ = np.count_nonzero(out != exact)
+            # pixels the exact path keeps but the fast one drops, should always be 0
+            lost = np.count_nonzero((exact != 0) & (out == 0))
+            print("%6d %4d %9.2f %7.2fx %8.2f%% %8.2f%% %6d"
+                  % (length, fast, ms, exact_ms / ms, 100.0 * removed / pixels, 100.0 * differ / pixels, lost))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,22 @@
+# Builds the tmaskcleaner Python module: python setup.py build_ext --inplace
+import sys
+from setuptools import setup, Extension
+
+if sys.platform == "win32":
+    compile_args = ["/O2", "/EHsc"]
+else:
+    compile_args = ["-O3", "-std=c++11", "-msse2"]
+
+setup(
+    name="tmaskcleaner",
+    version="1.0",
+    description="Mask cleaning from the TMaskCleaner AviSynth plugin",
+    ext_modules=[
+        Extension(
+            "tmaskcleaner",
+            sources=["tmaskcleaner_module.cpp", "../tmaskcleaner/cleaner.cpp"],
+            include_dirs=["../tmaskcleaner"],
+            extra_compile_args=compile_args,
+        )
+    ],
+)
@@ -0,0 +1,276 @@
+// Python bindings for the cleaning core. Arrays are read through the buffer protocol without
+// copying, results are returned as new NumPy arrays.
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include <vector>
+#include <algorithm>
+#include <thread>
+#include <atomic>
+#include <cstring>
+#include "cleaner.h"
+
+namespace {
+
+    // Buffer of a 2D or 3D uint8/uint16 array, released when it goes out of scope.
+    struct View {
+        Py_buffer buffer;
+        bool valid;
+        int depth;
+        int height;
+        int width;
+        ptrdiff_t frame_pitch;
+        ptrdiff_t pitch;
+
+        View(): valid(false) {}
+        ~View() { if (valid) PyBuffer_Release(&buffer); }
+
+        char* Frame(int n) const { return static_cast<char*>(buffer.buf) + frame_pitch * n; }
+    };
+
+    int ItemSize(const Py_buffer& b) {
+        const char* f = b.format ? b.format : "B";
+        if (*f == '<' || *f == '=' || *f == '@' || *f == '|') {
+            ++f;
+        }
+        if (strcmp(f, "B") == 0 && b.itemsize == 1) return 1;
+        if (strcmp(f, "H") == 0 && b.itemsize == 2) return 2;
+        return 0;
+    }
+
+    // Rows may use any stride, but pixels within a row have to be adjacent. Arrays strided along
+    // their rows are the only case that gets copied, through numpy.ascontiguousarray.
+    bool GetView(PyObject* obj, View& view, int flags) {
+        if (PyObject_GetBuffer(obj, &view.buffer, flags) < 0) {
+            return false;
+        }
+        view.valid = true;
+        Py_buffer& b = view.buffer;
+        if (b.ndim != 2 && b.ndim != 3) {
+            PyErr_SetString(PyExc_ValueError, "expected a 2D or 3D array");
+            return false;
+        }
+        if (ItemSize(b) == 0) {
+            PyErr_SetString(PyExc_TypeError, "expected an array of uint8 or uint16");
+            return false;
+        }
+        if (b.strides[b.ndim - 1] != b.itemsize) {
+            PyBuffer_Release(&b);
+            view.valid = false;
+            if ((flags & PyBUF_WRITABLE) != 0) {
+                PyErr_SetString(PyExc_ValueError, "rows of the output must be contiguous");
+                return false;
+            }
+            PyObject* numpy = PyImport_ImportModule("numpy");
+            if (numpy == nullptr) {
+                return false;
+            }
+            PyObject* contiguous = PyObject_CallMethod(numpy, "ascontiguousarray", "O", obj);
+            Py_DECREF(numpy);
+            if (contiguous == nullptr) {
+                return false;
+            }
+            bool ok = GetView(contiguous, view, flags);
+            Py_DECREF(contiguous);
+            return ok;
+        }
+        view.depth = b.ndim == 3 ? (int)b.shape[0] : 1;
+        view.height = (int)b.shape[b.ndim - 2];
+        view.width = (int)b.shape[b.ndim - 1];
+        view.frame_pitch = b.ndim == 3 ? b.strides[0] : 0;
+        view.pitch = b.strides[b.ndim - 2];
+        return true;
+    }
+
+    PyObject* NewArray(PyObject* shape, const char* dtype) {
+        PyObject* numpy = PyImport_ImportModule("numpy");
+        if (numpy == nullptr) {
+            return nullptr;
+        }
+        PyObject* array = PyObject_CallMethod(numpy, "empty", "Os", shape, dtype);
+        Py_DECREF(numpy);
+        return array;
+    }
+
+    PyObject* SizesArray(const std::vector<int>& sizes) {
+        // sizes[0] belongs to the background, component n is at index n - 1
+        Py_ssize_t n = sizes.empty() ? 0 : (Py_ssize_t)sizes.size() - 1;
+        PyObject* shape = Py_BuildValue("(n)", n);
+        if (shape == nullptr) {
+            return nullptr;
+        }
+        PyObject* array = NewArray(shape, "int32");
+        Py_DECREF(shape);
+        if (array == nullptr || n == 0) {
+            return array;
+        }
+        Py_buffer b;
+        if (PyObject_GetBuffer(array, &b, PyBUF_WRITABLE | PyBUF_C_CONTIGUOUS) < 0) {
+            Py_DECREF(array);
+            return nullptr;
+        }
+        memcpy(b.buf, &sizes[1], n * sizeof(int));
+        PyBuffer_Release(&b);
+        return array;
+    }
+
+    // Runs without the GIL, so errors are only reported through the return value.
+    template <class T>
+    bool CleanFrames(const View& src, const View* apply, const View& dst, int length, int thresh, int radius, int fast, int threads, std::vector<std::vector<int>>* sizes) {
+        MaskCleaner cleaner(src.width, src.height, length, thresh, radius, std::vector<int>(), false, fast);
+        std::atomic<int> next(0);
+        std::atomic<bool> failed(false);
+        auto worker = [&]() {
+            for (int n = next++; n < src.depth && !failed; n = next++) {
+                try {
+                    const View& a = apply != nullptr ? *apply : src;
+                    cleaner.Clean(reinterpret_cast<T*>(dst.Frame(n)), reinterpret_cast<const T*>(src.Frame(n)), reinterpret_cast<const T*>(a.Frame(n)),
+                        src.pitch, a.pitch, dst.pitch, sizes != nullptr ? &(*sizes)[n] : nullptr);
+                } catch (const std::bad_alloc&) {
+                    failed = true;
+                }
+            }
+        };
+        std::vector<std::thread> pool;
+        for (int i = 1; i < threads; i++) {
+            pool.push_back(std::thread(worker));
+        }
+        worker();
+        for (size_t i = 0; i < pool.size(); i++) {
+            pool[i].join();
+        }
+        return !failed;
+    }
+
+    const char clean_doc[] =
+        "clean(mask, length=5, thresh=None, radius=1, apply=None, threads=0, stats=False, fast=0)\n\n"
+        "Removes components of less than length pixels above thresh from a 2D (height, width) or\n"
+        "3D (frames, height, width) uint8 or uint16 array. thresh defaults to 235 scaled to the\n"
+        "bit depth. If apply is given the kept pixels are taken from it instead. Frames of a 3D array\n"
+        "are spread over threads, 0 uses all cores. With stats the component sizes in scan order\n"
+        "are returned as well, one int32 array per frame for 3D input. A fast factor of 2 or 4\n"
+        "finds components on blocks of that size for an approximate result, it can't be used with\n"
+        "radius or stats.";
+
+    PyObject* Clean(PyObject*, PyObject* args, PyObject* kwargs) {
+        static const char* keywords[] = { "mask", "length", "thresh", "radius", "apply", "threads", "stats", "fast", nullptr };
+        PyObject* mask_obj;
+        PyObject* thresh_obj = Py_None;
+        PyObject* apply_obj = Py_None;
+        int length = 5;
+        int radius = 1;
+        int threads = 0;
+        int stats = 0;
+        int fast = 0;
+        if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|iOiOipi", const_cast<char**>(keywords),
+                &mask_obj, &length, &thresh_obj, &radius, &apply_obj, &threads, &stats, &fast)) {
+            return nullptr;
+        }
+
+        View src;
+        if (!GetView(mask_obj, src, PyBUF_RECORDS_RO)) {
+            return nullptr;
+        }
+        int itemsize = (int)src.buffer.itemsize;
+        int thresh = itemsize == 1 ? 235 : 235 << 8;
+        if (thresh_obj != Py_None) {
+            thresh = (int)PyLong_AsLong(thresh_obj);
+            if (PyErr_Occurred()) {
+                return nullptr;
+            }
+        }
+        if (length <= 0 || thresh <= 0 || radius < 1 || threads < 0) {
+            PyErr_SetString(PyExc_ValueError, "invalid arguments");
+            return nullptr;
+        }
+        if ((fast != 0 && fast != 2 && fast != 4) || (fast != 0 && (stats || radius > 1))) {
+            PyErr_SetString(PyExc_ValueError, "fast must be 0, 2 or 4 and can't be used with radius or stats");
+            return nullptr;
+        }
+
+        View apply;
+        if (apply_obj != Py_None) {
+            if (!GetView(apply_obj, apply, PyBUF_RECORDS_RO)) {
+                return nullptr;
+            }
+            if (apply.buffer.ndim != src.buffer.ndim || apply.buffer.itemsize != itemsize
+                    || apply.depth != src.depth || apply.height != src.height || apply.width != src.width) {
+                PyErr_SetString(PyExc_ValueError, "apply must have the same shape and dtype as mask");
+                return nullptr;
+            }
+        }
+
+        PyObject* shape = PyTuple_New(src.buffer.ndim);
+        if (shape == nullptr) {
+            return nullptr;
+        }
+        for (int i = 0; i < src.buffer.ndim; i++) {
+            PyTuple_SET_ITEM(shape, i, PyLong_FromSsize_t(src.buffer.shape[i]));
+        }
+        PyObject* out = NewArray(shape, itemsize == 1 ? "uint8" : "uint16");
+        Py_DECREF(shape);
+        if (out == nullptr) {
+            return nullptr;
+        }
+        bool ok;
+        std::vector<std::vector<int>> sizes(stats ? src.depth : 0);
+        {
+            View dst;
+            if (!GetView(out, dst, PyBUF_RECORDS)) {
+                Py_DECREF(out);
+                return nullptr;
+            }
+            if (threads == 0) {
+                threads = (int)std::thread::hardware_concurrency();
+            }
+            threads = std::max(1, std::min(threads, src.depth));
+            const View* a = apply.valid ? &apply : nullptr;
+            Py_BEGIN_ALLOW_THREADS
+            if (itemsize == 1) {
+                ok = CleanFrames<uint8_t>(src, a, dst, length, thresh, radius, fast, threads, stats ? &sizes : nullptr);
+            } else {
+                ok = CleanFrames<uint16_t>(src, a, dst, length, thresh, radius, fast, threads, stats ? &sizes : nullptr);
+            }
+            Py_END_ALLOW_THREADS
+        }
+        if (!ok) {
+            Py_DECREF(out);
+            return PyErr_NoMemory();
+        }
+        if (!stats) {
+            return out;
+        }
+
+        PyObject* result;
+        if (src.buffer.ndim == 2) {
+            result = SizesArray(sizes[0]);
+        } else {
+            result = PyList_New(src.depth);
+            for (int n = 0; result != nullptr && n < src.depth; n++) {
+                PyObject* s = SizesArray(sizes[n]);
+                if (s == nullptr) {
+                    Py_CLEAR(result);
+                    break;
+                }
+                PyList_SET_ITEM(result, n, s);
+            }
+        }
+        if (result == nullptr) {
+            Py_DECREF(out);
+            return nullptr;
+        }
+        return Py_BuildValue("(NN)", out, result);
+    }
+
+    PyMethodDef methods[] = {
+        { "clean", reinterpret_cast<PyCFunction>(Clean), METH_VARARGS | METH_KEYWORDS, clean_doc },
+        { nullptr, nullptr, 0, nullptr }
+    };
+
+    PyModuleDef module = {
+        PyModuleDef_HEAD_INIT, "tmaskcleaner", "Mask cleaning from the TMaskCleaner AviSynth plugin.", -1, methods
+    };
+}
+
+PyMODINIT_FUNC PyInit_tmaskcleaner() {
+    return PyModule_Create(&module);
+}
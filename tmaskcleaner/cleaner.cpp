@@ -0,0 +1,998 @@
+#ifdef _WIN32
+#define NOMINMAX
+#include <Windows.h>
+#include <Psapi.h>
+#include <intrin.h>
+#else
+#include <linux/mempolicy.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+#include <algorithm>
+#include <bitset>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <type_traits>
+#include <emmintrin.h>
+#include "cleaner.h"
+
+namespace {
+    // Lengths up to this one get a bitboard kernel, its window of 2 * length - 1 columns fits a uint32_t.
+    const unsigned int kSmallLength = 16;
+    // Buffers below this size come from the heap, page granular allocation isn't worth it for them.
+    const size_t kPageAllocMin = 64 << 10;
+}
+
+AllocStats& Stats() {
+    static AllocStats stats;
+    return stats;
+}
+
+int CurrentNode() {
+#ifdef _WIN32
+    PROCESSOR_NUMBER processor;
+    USHORT node;
+    GetCurrentProcessorNumberEx(&processor);
+    if (GetNumaProcessorNodeEx(&processor, &node)) {
+        return node;
+    }
+    return 0;
+#else
+    unsigned int cpu, node;
+    if (syscall(SYS_getcpu, &cpu, &node, nullptr) == 0) {
+        return node;
+    }
+    return 0;
+#endif
+}
+
+namespace {
+#ifndef _WIN32
+    // AnonHugePages of the mapping containing p, in kB.
+    unsigned long AnonHugePages(const void* p) {
+        FILE* f = fopen("/proc/self/smaps", "r");
+        if (f == nullptr) {
+            return 0;
+        }
+        uintptr_t a = reinterpret_cast<uintptr_t>(p);
+        unsigned long kb = 0;
+        bool inside = false;
+        char line[512];
+        while (fgets(line, sizeof(line), f) != nullptr) {
+            unsigned long start, end;
+            if (sscanf(line, "%lx-%lx ", &start, &end) == 2) {
+                if (inside) {
+                    break;
+                }
+                inside = start <= a && a < end;
+            } else if (inside && sscanf(line, "AnonHugePages: %lu kB", &kb) == 1) {
+                break;
+            }
+        }
+        fclose(f);
+        return kb;
+    }
+#endif
+
+    // Touches fresh pages and counts what they really got. Node and page size are only a preference
+    // to the allocation calls, so the node and page size of the touched page are read back.
+    void CountPlacement(void* p, size_t bytes, int node, bool large) {
+        AllocStats& stats = Stats();
+#ifdef _WIN32
+        *static_cast<volatile char*>(p) = 0;
+        PSAPI_WORKING_SET_EX_INFORMATION info;
+        info.VirtualAddress = p;
+        if (QueryWorkingSetEx(GetCurrentProcess(), &info, sizeof(info)) && info.VirtualAttributes.Valid) {
+            large = info.VirtualAttributes.LargePage != 0;
+            if ((int)info.VirtualAttributes.Node == node) {
+                ++stats.numa_local;
+            }
+        }
+        if (large) {
+            ++stats.large_pages;
+        } else {
+            ++stats.regular_pages;
+        }
+#else
+        // a transparent huge page can only back an aligned 2MB range inside the mapping
+        const uintptr_t huge = 2 << 20;
+        uintptr_t begin = reinterpret_cast<uintptr_t>(p);
+        uintptr_t aligned = (begin + huge - 1) & ~(huge - 1);
+        char* touch = static_cast<char*>(p);
+        bool transparent = false;
+        if (!large && aligned + huge <= begin + bytes) {
+            // neighbouring mappings may have merged with this one, so compare before and after
+            touch = reinterpret_cast<char*>(aligned);
+            unsigned long before = AnonHugePages(touch);
+            *static_cast<volatile char*>(touch) = 0;
+            transparent = AnonHugePages(touch) > before;
+        } else {
+            *static_cast<volatile char*>(touch) = 0;
+        }
+        int actual = -1;
+        if (syscall(SYS_get_mempolicy, &actual, nullptr, 0, touch, MPOL_F_NODE | MPOL_F_ADDR) == 0 && actual == node) {
+            ++stats.numa_local;
+        }
+        if (large) {
+            ++stats.large_pages;
+        } else if (transparent) {
+            ++stats.transparent_pages;
+        } else {
+            ++stats.regular_pages;
+        }
+#endif
+    }
+}
+
+#ifdef _WIN32
+namespace {
+    // Large pages need SeLockMemoryPrivilege enabled in the process token. Holding the right isn't
+    // enough, it starts out disabled, so it is switched on once before the first attempt.
+    bool EnableLockMemory() {
+        HANDLE token;
+        if (!OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &token)) {
+            return false;
+        }
+        TOKEN_PRIVILEGES privileges;
+        privileges.PrivilegeCount = 1;
+        privileges.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+        bool enabled = LookupPrivilegeValue(nullptr, SE_LOCK_MEMORY_NAME, &privileges.Privileges[0].Luid)
+            && AdjustTokenPrivileges(token, FALSE, &privileges, 0, nullptr, nullptr)
+            // succeeds with ERROR_NOT_ALL_ASSIGNED when the account doesn't hold the right
+            && GetLastError() == ERROR_SUCCESS;
+        CloseHandle(token);
+        return enabled;
+    }
+
+    bool LockMemoryEnabled() {
+        static std::once_flag once;
+        static bool enabled = false;
+        std::call_once(once, []() {
+            enabled = EnableLockMemory();
+            if (!enabled) {
+                ++Stats().no_privilege;
+            }
+        });
+        return enabled;
+    }
+}
+#endif
+
+// Frame sized scratch is placed on the given NUMA node and, if huge is set, backed by large pages
+// when the system grants them. bytes is updated to the size that was actually mapped.
+void* Allocate(size_t& bytes, int node, bool huge, AllocKind& kind) {
+    if (bytes < kPageAllocMin) {
+        kind = ALLOC_HEAP;
+        ++Stats().heap;
+#ifdef _WIN32
+        return _aligned_malloc(bytes, 16);
+#else
+        void* p = nullptr;
+        return posix_memalign(&p, 16, bytes) == 0 ? p : nullptr;
+#endif
+    }
+    kind = ALLOC_PAGES;
+    void* p = nullptr;
+    bool large = false;
+#ifdef _WIN32
+    // without SeLockMemoryPrivilege normal pages are used
+    SIZE_T page = GetLargePageMinimum();
+    if (huge && page != 0 && LockMemoryEnabled()) {
+        size_t rounded = (bytes + page - 1) & ~(page - 1);
+        p = VirtualAllocExNuma(GetCurrentProcess(), nullptr, rounded, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE, node);
+        if (p != nullptr) {
+            bytes = rounded;
+            large = true;
+        }
+    }
+    if (p == nullptr) {
+        p = VirtualAllocExNuma(GetCurrentProcess(), nullptr, bytes, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE, node);
+        if (p == nullptr) {
+            return nullptr;
+        }
+    }
+#else
+    const size_t page = 2 << 20;
+    if (huge) {
+        size_t rounded = (bytes + page - 1) & ~(page - 1);
+        p = mmap(nullptr, rounded, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (p != MAP_FAILED) {
+            bytes = rounded;
+            large = true;
+        } else {
+            p = nullptr;
+        }
+    }
+    if (p == nullptr) {
+        p = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED) {
+            return nullptr;
+        }
+        // no reserved huge pages, ask for transparent ones instead
+        if (huge) {
+            madvise(p, bytes, MADV_HUGEPAGE);
+        }
+    }
+    // MPOL_PREFERRED, so the pages still come from elsewhere when the node runs out. The kernel
+    // reads maxnode - 1 bits of the mask, hence the extra one.
+    if (node < 64) {
+        unsigned long mask = 1UL << node;
+        syscall(SYS_mbind, p, bytes, MPOL_PREFERRED, &mask, sizeof(mask) * 8 + 1, 0);
+    }
+#endif
+    CountPlacement(p, bytes, node, large);
+    return p;
+}
+
+void Deallocate(void* p, size_t bytes, AllocKind kind) {
+    if (kind == ALLOC_HEAP) {
+#ifdef _WIN32
+        _aligned_free(p);
+#else
+        free(p);
+#endif
+        return;
+    }
+#ifdef _WIN32
+    VirtualFree(p, 0, MEM_RELEASE);
+#else
+    munmap(p, bytes);
+#endif
+}
+
+namespace {
+    template <class T>
+    T* Row(T* p, ptrdiff_t pitch, int y) {
+        typedef typename std::conditional<std::is_const<T>::value, const char, char>::type Byte;
+        return reinterpret_cast<T*>(reinterpret_cast<Byte*>(p) + pitch * y);
+    }
+
+    struct SelectOp {
+        __m128i operator()(__m128i a, __m128i m) const { return _mm_and_si128(a, m); }
+        template <class T>
+        T operator()(T a, uint8_t m) const { return m ? a : 0; }
+    };
+
+    // Keeps pixels whose rank is above level.
+    struct RankOp {
+        __m128i l;
+        uint8_t level;
+
+        RankOp(int level_): l(_mm_set1_epi8(level_)), level(level_) {}
+        __m128i operator()(__m128i a, __m128i r) const { return _mm_and_si128(a, _mm_cmpgt_epi8(r, l)); }
+        template <class T>
+        T operator()(T a, uint8_t r) const { return r > level ? a : 0; }
+    };
+
+    template <class T, class Op>
+    void ApplyRow(T* dst, const T* a, const uint8_t* m, int w, const Op& op) {
+        for(int x = 0; x < w; x++){
+            dst[x] = op(a[x], m[x]);
+        }
+    }
+
+    // Writes op(a, m) for one row. The head is peeled until dst is aligned, the body uses aligned
+    // loads when the inputs share that alignment and unaligned loads otherwise, the tail is scalar.
+    // This keeps cropped and oddly pitched clips on the SIMD path without copying them.
+    template <class Op>
+    void ApplyRow(uint8_t* dst, const uint8_t* a, const uint8_t* m, int w, const Op& op) {
+        int head = std::min(w, (int)((16 - (reinterpret_cast<uintptr_t>(dst) & 15)) & 15));
+        int x = 0;
+        for(; x < head; x++){
+            dst[x] = op(a[x], m[x]);
+        }
+        if (((reinterpret_cast<uintptr_t>(a + x) | reinterpret_cast<uintptr_t>(m + x)) & 15) == 0) {
+            for(; x + 16 <= w; x += 16){
+                __m128i va = _mm_load_si128(reinterpret_cast<const __m128i*>(a+x));
+                __m128i vm = _mm_load_si128(reinterpret_cast<const __m128i*>(m+x));
+                _mm_store_si128(reinterpret_cast<__m128i*>(dst+x), op(va,vm));
+            }
+        } else {
+            for(; x + 16 <= w; x += 16){
+                __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a+x));
+                __m128i vm = _mm_loadu_si128(reinterpret_cast<const __m128i*>(m+x));
+                _mm_store_si128(reinterpret_cast<__m128i*>(dst+x), op(va,vm));
+            }
+        }
+        for(; x < w; x++){
+            dst[x] = op(a[x], m[x]);
+        }
+    }
+
+    // dst gets apply where m is 0xFF and 0 elsewhere.
+    template <class T>
+    void ApplyMask(T* dst, const T* apply, const uint8_t* m, int w, int h, ptrdiff_t apply_pitch, ptrdiff_t dst_pitch, int mask_pitch) {
+        SelectOp op;
+        for(int y = 0; y < h; y++){
+            ApplyRow(dst, apply, m, w, op);
+            dst = Row(dst, dst_pitch, 1);
+            apply = Row(apply, apply_pitch, 1);
+            m += mask_pitch;
+        }
+    }
+
+    // Sets bit x of bits for every pixel of s above thresh.
+    template <class T>
+    void ThresholdRow(uint64_t* bits, const T* s, int w, unsigned int thresh) {
+        for(int x = 0; x < w; x++){
+            if (s[x] > thresh) {
+                bits[x >> 6] |= uint64_t(1) << (x & 63);
+            }
+        }
+    }
+
+    void ThresholdRow(uint64_t* bits, const uint8_t* s, int w, unsigned int thresh) {
+        if (thresh >= 255) {
+            return;
+        }
+        // there is no unsigned compare in SSE2, flipping the sign bit turns it into a signed one
+        const __m128i sign = _mm_set1_epi8(-128);
+        const __m128i t = _mm_set1_epi8((char)(thresh ^ 0x80));
+        int x = 0;
+        for(; x + 16 <= w; x += 16){
+            __m128i v = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(s+x)), sign);
+            uint64_t m = (unsigned int)_mm_movemask_epi8(_mm_cmpgt_epi8(v, t));
+            bits[x >> 6] |= m << (x & 63);
+        }
+        for(; x < w; x++){
+            if (s[x] > thresh) {
+                bits[x >> 6] |= uint64_t(1) << (x & 63);
+            }
+        }
+    }
+
+    // Reduces rows lines of src into F x F blocks. Bit F * j + i of a block is set when its pixel
+    // (i, j) is above thresh.
+    template <int F, class T>
+    void ReduceRow(uint16_t* occ, const T* src, ptrdiff_t src_pitch, int rows, int w, unsigned int thresh) {
+        memset(occ, 0, (w + F - 1) / F * sizeof(uint16_t));
+        for(int j = 0; j < rows; j++){
+            const T* s = Row(src, src_pitch, j);
+            for(int x = 0; x < w; x++){
+                if (s[x] > thresh) {
+                    occ[x / F] |= 1 << (F * j + x % F);
+                }
+            }
+        }
+    }
+
+    // Each pixel above thresh contributes its bit of the block, adding up the bytes of a block
+    // then builds the mask. Rows 0 and 1 fill the low byte of a 4x4 block, rows 2 and 3 the high one.
+    template <int F>
+    void ReduceRow(uint16_t* occ, const uint8_t* src, ptrdiff_t src_pitch, int rows, int w, unsigned int thresh) {
+        memset(occ, 0, (w + F - 1) / F * sizeof(uint16_t));
+        if (thresh >= 255) {
+            return;
+        }
+        const __m128i sign = _mm_set1_epi8(-128);
+        const __m128i t = _mm_set1_epi8((char)(thresh ^ 0x80));
+        const __m128i low = _mm_set1_epi16(0xFF);
+        __m128i weight[4];
+        for(int j = 0; j < F; j++){
+            int shift = F == 2 ? 2 * j : 4 * (j & 1);
+            weight[j] = F == 2 ? _mm_set1_epi16((short)(0x0201u << shift)) : _mm_set1_epi32((int)(0x08040201u << shift));
+        }
+        int x = 0;
+        for(; x + 16 <= w; x += 16){
+            __m128i v[4];
+            for(int j = 0; j < F; j++){
+                v[j] = _mm_setzero_si128();
+                if (j < rows) {
+                    __m128i s = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(Row(src, src_pitch, j)+x)), sign);
+                    v[j] = _mm_and_si128(_mm_cmpgt_epi8(s, t), weight[j]);
+                }
+            }
+            if (F == 2) {
+                __m128i b = _mm_or_si128(v[0], v[1]);
+                b = _mm_add_epi16(_mm_and_si128(b, low), _mm_srli_epi16(b, 8));
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(occ+x/2), b);
+            } else {
+                __m128i lo = _mm_or_si128(v[0], v[1]);
+                __m128i hi = _mm_or_si128(v[2], v[3]);
+                lo = _mm_madd_epi16(_mm_add_epi16(_mm_and_si128(lo, low), _mm_srli_epi16(lo, 8)), _mm_set1_epi16(1));
+                hi = _mm_madd_epi16(_mm_add_epi16(_mm_and_si128(hi, low), _mm_srli_epi16(hi, 8)), _mm_set1_epi16(1));
+                // the masks use all 16 bits, bias them so the signed pack doesn't saturate
+                __m128i b = _mm_sub_epi32(_mm_or_si128(lo, _mm_slli_epi32(hi, 8)), _mm_set1_epi32(0x8000));
+                b = _mm_add_epi16(_mm_packs_epi32(b, b), _mm_set1_epi16(-0x8000));
+                _mm_storel_epi64(reinterpret_cast<__m128i*>(occ+x/4), b);
+            }
+        }
+        for(int j = 0; j < rows; j++){
+            const uint8_t* s = Row(src, src_pitch, j);
+            for(int i = x; i < w; i++){
+                if (s[i] > thresh) {
+                    occ[i / F] |= 1 << (F * j + i % F);
+                }
+            }
+        }
+    }
+
+    // Edges of an occupancy mask of ReduceRow, one bit per pixel.
+    template <int F>
+    struct Block {
+        static unsigned int Top(unsigned int m) { return m & ((1 << F) - 1); }
+        static unsigned int Bottom(unsigned int m) { return m >> (F * (F - 1)); }
+        static unsigned int Left(unsigned int m) {
+            unsigned int c = 0;
+            for(int j = 0; j < F; j++){
+                c |= ((m >> (F * j)) & 1) << j;
+            }
+            return c;
+        }
+        static unsigned int Right(unsigned int m) { return Left(m >> (F - 1)); }
+    };
+
+    inline unsigned int Spread(unsigned int m) {
+        return m | m << 1 | m >> 1;
+    }
+
+    // Decides which blocks to keep. Blocks are the nodes of a union-find, neighbouring ones are only
+    // linked where their pixels touch across the shared edge or corner, so the only approximation
+    // is that pieces within one block count as connected. Components are sized by their pixels.
+    // Most blocks are empty, parent and sums are only used for the others.
+    template <int F>
+    void KeepBlocks(uint8_t* keep, const uint16_t* occ, int* parent, int* sums, int rw, int rh, int length) {
+        typedef Block<F> B;
+        for(int y = 0; y < rh; y++){
+            for(int x = 0; x < rw; x++){
+                int i = rw * y + x;
+                unsigned int m = occ[i];
+                if (m == 0) {
+                    continue;
+                }
+                parent[i] = i;
+                if (x > 0 && (B::Right(occ[i - 1]) & Spread(B::Left(m)))) {
+                    Union(parent, i - 1, i);
+                }
+                if (y > 0) {
+                    if (B::Bottom(occ[i - rw]) & Spread(B::Top(m))) {
+                        Union(parent, i - rw, i);
+                    }
+                    if (x > 0 && (occ[i - rw - 1] >> (F * F - 1)) && (m & 1)) {
+                        Union(parent, i - rw - 1, i);
+                    }
+                    if (x + 1 < rw && (occ[i - rw + 1] >> (F * (F - 1)) & 1) && (m >> (F - 1) & 1)) {
+                        Union(parent, i - rw + 1, i);
+                    }
+                }
+            }
+        }
+        // roots are the first block of their component, so one pass in scan order resolves them
+        for(int i = 0; i < rw * rh; i++){
+            if (occ[i] == 0) {
+                continue;
+            }
+            int pixels = (int)std::bitset<16>(occ[i]).count();
+            if (parent[i] == i) {
+                sums[i] = pixels;
+            } else {
+                parent[i] = parent[parent[i]];
+                sums[parent[i]] += pixels;
+            }
+        }
+        for(int i = 0; i < rw * rh; i++){
+            keep[i] = occ[i] != 0 && sums[parent[i]] >= length ? 0xFF : 0;
+        }
+    }
+
+    // m gets 0xFF where src is above thresh and the block it was reduced into was kept.
+    template <class T>
+    void ExpandRow(uint8_t* m, const T* s, const uint8_t* keep, int w, int f, unsigned int thresh) {
+        for(int x = 0; x < w; x++){
+            m[x] = s[x] > thresh ? keep[x / f] : 0;
+        }
+    }
+
+    void ExpandRow(uint8_t* m, const uint8_t* s, const uint8_t* keep, int w, int f, unsigned int thresh) {
+        if (thresh >= 255) {
+            memset(m, 0, w);
+            return;
+        }
+        const __m128i sign = _mm_set1_epi8(-128);
+        const __m128i t = _mm_set1_epi8((char)(thresh ^ 0x80));
+        int x = 0;
+        for(; x + 16 <= w; x += 16){
+            __m128i k;
+            if (f == 2) {
+                k = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(keep+x/2));
+                k = _mm_unpacklo_epi8(k, k);
+            } else {
+                int four;
+                memcpy(&four, keep+x/4, 4);
+                k = _mm_cvtsi32_si128(four);
+                k = _mm_unpacklo_epi8(k, k);
+                k = _mm_unpacklo_epi8(k, k);
+            }
+            __m128i v = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(s+x)), sign);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(m+x), _mm_and_si128(_mm_cmpgt_epi8(v, t), k));
+        }
+        for(; x < w; x++){
+            m[x] = s[x] > thresh ? keep[x / f] : 0;
+        }
+    }
+
+    inline int LowestBit(uint64_t v) {
+#ifdef _MSC_VER
+        unsigned long i;
+        if (_BitScanForward(&i, (unsigned long)v)) {
+            return i;
+        }
+        _BitScanForward(&i, (unsigned long)(v >> 32));
+        return i + 32;
+#else
+        return __builtin_ctzll(v);
+#endif
+    }
+
+    // 32 bits of a bit plane row starting at column x0, columns left of the frame read as 0.
+    // Rows carry a spare word at the end, so the second word is always there.
+    inline uint32_t Window(const uint64_t* row, int x0) {
+        if (x0 < 0) {
+            return (uint32_t)(row[0] << -x0);
+        }
+        int s = x0 & 63;
+        uint64_t v = row[x0 >> 6] >> s;
+        if (s != 0) {
+            v |= row[(x0 >> 6) + 1] << (64 - s);
+        }
+        return (uint32_t)v;
+    }
+
+    inline void ClearWindow(uint64_t* row, int x0, uint32_t bits) {
+        if (x0 < 0) {
+            row[0] &= ~(uint64_t(bits) >> -x0);
+            return;
+        }
+        int s = x0 & 63;
+        row[x0 >> 6] &= ~(uint64_t(bits) << s);
+        if (s != 0) {
+            row[(x0 >> 6) + 1] &= ~(uint64_t(bits) >> (64 - s));
+        }
+    }
+
+    // Flood fill over the bit plane that marks the whole component in m and clears it from the plane.
+    void KeepComponent(uint64_t* bits, int words, int w, int h, int x, int y, uint8_t* m, int mask_pitch, Coordinates* coordinates) {
+        bits[words * y + (x >> 6)] &= ~(uint64_t(1) << (x & 63));
+        m[mask_pitch * y + x] = 0xFF;
+        coordinates[0] = Coordinates(x, y);
+        int cs = 1;
+        while(cs>0){
+            Coordinates current = coordinates[--cs];
+            int x_min = current.first  == 0 ? 0 : current.first - 1;
+            int x_max = current.first  == w - 1 ? w : current.first + 2;
+            int y_min = current.second == 0 ? 0 : current.second - 1;
+            int y_max = current.second == h - 1 ? h : current.second + 2;
+            for (int j = y_min; j < y_max; ++j ) {
+                uint64_t* row = bits + words * j;
+                for (int i = x_min; i < x_max; ++i ) {
+                    uint64_t bit = uint64_t(1) << (i & 63);
+                    if (row[i >> 6] & bit) {
+                        row[i >> 6] &= ~bit;
+                        m[mask_pitch * j + i] = 0xFF;
+                        coordinates[cs++] = Coordinates(i, j);
+                    }
+                }
+            }
+        }
+    }
+
+    // Settles every component of the bit plane for a length of L. Seeds are taken in scan order, so
+    // a component below L pixels lies within L rows from the seed down and L - 1 columns to either
+    // side. It is grown there in registers, one uint32_t per row, loading rows only once the fill
+    // reaches them. If the growth stops short of L pixels the component is complete and dropped,
+    // otherwise it is kept by the general flood fill.
+    template <int L>
+    void SettleComponents(uint64_t* bits, int words, int w, int h, uint8_t* m, int mask_pitch, Coordinates* coordinates) {
+        const uint32_t span = (1u << (2 * L - 1)) - 1;
+        uint32_t window[L];
+        uint32_t fill[L];
+        for(int y = 0; y < h; ++y) {
+            uint64_t* row = bits + words * y;
+            int rows = std::min(L, h - y);
+            for(int k = 0; k < words; ++k) {
+                while (row[k] != 0) {
+                    int x = k * 64 + LowestBit(row[k]);
+                    int x0 = x - (L - 1);
+                    window[0] = Window(row, x0) & span;
+                    fill[0] = 1u << (L - 1);
+                    int n = 1;
+                    int count = 1;
+                    bool changed = true;
+                    // every pass that changes something adds a pixel, so this ends within L passes
+                    while (changed && count < L) {
+                        changed = false;
+                        for (int j = 0; j < n; ++j) {
+                            if (j == n - 1 && n < rows && fill[j] != 0) {
+                                window[n] = Window(row + words * n, x0) & span;
+                                fill[n++] = 0;
+                            }
+                            uint32_t f = fill[j] | (j > 0 ? fill[j - 1] : 0) | (j + 1 < n ? fill[j + 1] : 0);
+                            f = (f | f << 1 | f >> 1) & window[j];
+                            changed |= f != fill[j];
+                            fill[j] = f;
+                        }
+                        for (int j = n - 2; j >= 0; --j) {
+                            uint32_t f = fill[j] | fill[j + 1] | (j > 0 ? fill[j - 1] : 0);
+                            f = (f | f << 1 | f >> 1) & window[j];
+                            changed |= f != fill[j];
+                            fill[j] = f;
+                        }
+                        count = 0;
+                        for (int j = 0; j < n; ++j) {
+                            count += (int)std::bitset<32>(fill[j]).count();
+                        }
+                    }
+                    if (count < L) {
+                        for (int j = 0; j < n; ++j) {
+                            ClearWindow(row + words * j, x0, fill[j]);
+                        }
+                    } else {
+                        KeepComponent(bits, words, w, h, x, y, m, mask_pitch, coordinates);
+                    }
+                }
+            }
+        }
+    }
+
+    typedef void (*SettleKernel)(uint64_t*, int, int, int, uint8_t*, int, Coordinates*);
+
+    const SettleKernel settle_kernels[kSmallLength + 1] = {
+        nullptr,
+        SettleComponents<1>,  SettleComponents<2>,  SettleComponents<3>,  SettleComponents<4>,
+        SettleComponents<5>,  SettleComponents<6>,  SettleComponents<7>,  SettleComponents<8>,
+        SettleComponents<9>,  SettleComponents<10>, SettleComponents<11>, SettleComponents<12>,
+        SettleComponents<13>, SettleComponents<14>, SettleComponents<15>, SettleComponents<16>
+    };
+}
+
+MaskCleaner::MaskCleaner(int width, int height, int length, int thresh, int radius, const std::vector<int>& lengths, bool hugepages, int fast) :
+    m_length(length),
+    m_thresh(thresh),
+    m_radius(radius),
+    m_hugepages(hugepages),
+    m_lengths(lengths),
+    m_w(width),
+    m_h(height),
+    m_fast(fast),
+    buffer(length),
+    labels(height * width, hugepages),
+    mask(height * ((width + 15) & ~15), hugepages),
+    coords(height * width, hugepages),
+    runs(height * ((width + 1) / 2), hugepages),
+    parents(height * ((width + 1) / 2), hugepages),
+    bits(height * ((width + 63) / 64 + 1), hugepages),
+    occupancy(fast > 1 ? (height + fast - 1) / fast * ((width + fast - 1) / fast) : 0, hugepages),
+    blocks(fast > 1 ? (height + fast - 1) / fast * ((width + fast - 1) / fast) : 0, hugepages),
+    kept(fast > 1 ? (height + fast - 1) / fast * ((width + fast - 1) / fast) : 0, hugepages)
+{
+    if (m_lengths.empty()) {
+        m_lengths.push_back(length);
+    }
+    m_sorted_lengths = m_lengths;
+    std::sort(m_sorted_lengths.begin(), m_sorted_lengths.end());
+}
+
+template <class T>
+void MaskCleaner::Clean(T *dst, const T *src, const T *apply, ptrdiff_t src_pitch, ptrdiff_t apply_pitch, ptrdiff_t dst_pitch, std::vector<int>* sizes) {
+    if (m_fast > 1 && sizes == nullptr && m_radius == 1) {
+        ClearMaskReduced(dst, src, apply, src_pitch, apply_pitch, dst_pitch);
+        return;
+    }
+    // the flood fill stops counting at length, the labeler is needed for sizes and a radius
+    if (sizes == nullptr && m_radius == 1) {
+        if (m_length <= kSmallLength) {
+            ClearMaskSmall(dst, src, apply, src_pitch, apply_pitch, dst_pitch);
+        } else {
+            ClearMask(dst, src, apply, src_pitch, apply_pitch, dst_pitch);
+        }
+        return;
+    }
+    PComponents c = Label(src, src_pitch);
+    ClearMaskSweep(dst, c->labels.ptr, c->sizes, apply, apply_pitch, dst_pitch);
+    if (sizes != nullptr) {
+        *sizes = c->sizes;
+    }
+}
+
+template <class T>
+PComponents MaskCleaner::Label(const T *src, ptrdiff_t src_pitch, bool pooled) {
+    if (pooled) {
+        // pooled results go back to the buffer pool once they are released
+        Components* c = new Components;
+        c->labels = labels.Acquire();
+        LabelComponents(c->labels.ptr, c->sizes, src, src_pitch);
+        return PComponents(c, [this](const Components* p) {
+            labels.Release(const_cast<Components*>(p)->labels);
+            delete p;
+        });
+    }
+    std::shared_ptr<Components> c = std::make_shared<Components>();
+    c->labels = Array<int>(m_w * m_h, m_hugepages);
+    LabelComponents(c->labels.ptr, c->sizes, src, src_pitch);
+    return c;
+}
+
+template <class T>
+void MaskCleaner::ClearMask(T *dst, const T *src, const T *apply, ptrdiff_t src_pitch, ptrdiff_t apply_pitch, ptrdiff_t dst_pitch) {
+    int w = m_w;
+    int h = m_h;
+    Array<int> buffer_accessor = buffer.Acquire();
+    Array<uint8_t> mask_accessor = mask.Acquire();
+    Array<Coordinates> coords_accessor = coords.Acquire();
+    int* buf = buffer_accessor.ptr;
+    uint8_t* m = mask_accessor.ptr;
+    Coordinates* coordinates = coords_accessor.ptr;
+    // the scratch mask has its own pitch, so it doesn't depend on how the source frame is laid out
+    int mask_pitch = (w + 15) & ~15;
+    memset(m,1,h*mask_pitch);
+    int b,cs;
+    Coordinates current;
+    for(int y = 0; y < h; ++y) {
+        for(int x = 0; x < w; ++x) {
+            int pos = mask_pitch * y + x;
+            if (m[pos]!=1) {
+                continue;
+            }
+            m[pos]=0;
+            if(Row(src, src_pitch, y)[x]<=m_thresh) {
+                continue;
+            }
+            buf[0]=pos;
+            b=1;
+            coordinates[0] = Coordinates(x,y);
+            cs = 1;
+            while(cs>0){
+                current = coordinates[--cs];
+                int x_min = current.first  == 0 ? 0 : current.first - 1;
+                int x_max = current.first  == w - 1 ? w : current.first + 2;
+                int y_min = current.second == 0 ? 0 : current.second - 1;
+                int y_max = current.second == h - 1 ? h : current.second + 2;
+                for (int j = y_min; j < y_max; ++j ) {
+                    for (int i = x_min; i < x_max; ++i ) {
+                        pos = mask_pitch * j + i;
+                        if (m[pos]==1){
+                            m[pos]=0;
+                            if(Row(src, src_pitch, j)[i]>m_thresh){
+                                coordinates[cs++] = Coordinates(i,j);
+                                if(b<m_length){
+                                    buf[b++] = pos;
+                                } else {
+                                    m[pos] = 0xFF;
+                                }
+                            }
+
+                        }
+                    }
+                }
+            }
+            if(b>=m_length){
+                for(int i = 0;i<m_length;i++){
+                    m[buf[i]] = 0xFF;
+                }
+            }
+        }
+    }
+
+    // m holds 0xFF for kept pixels and 0 otherwise, so the AND selects apply where the component survived
+    ApplyMask(dst, apply, m, w, h, apply_pitch, dst_pitch, mask_pitch);
+    buffer.Release(buffer_accessor);
+    mask.Release(mask_accessor);
+    coords.Release(coords_accessor);
+}
+
+// Same result as ClearMask for lengths up to kSmallLength. The thresholded frame is packed into a
+// bit plane that also tracks which pixels are still unvisited, most components are then settled
+// by a kernel specialized for the length without touching a frame sized index buffer.
+template <class T>
+void MaskCleaner::ClearMaskSmall(T *dst, const T *src, const T *apply, ptrdiff_t src_pitch, ptrdiff_t apply_pitch, ptrdiff_t dst_pitch) {
+    int w = m_w;
+    int h = m_h;
+    Array<uint64_t> bits_accessor = bits.Acquire();
+    Array<uint8_t> mask_accessor = mask.Acquire();
+    Array<Coordinates> coords_accessor = coords.Acquire();
+    uint64_t* plane = bits_accessor.ptr;
+    uint8_t* m = mask_accessor.ptr;
+    int words = (w + 63) / 64 + 1;
+    int mask_pitch = (w + 15) & ~15;
+    memset(plane,0,h*words*sizeof(uint64_t));
+    memset(m,0,h*mask_pitch);
+    for(int y = 0; y < h; ++y) {
+        ThresholdRow(plane + words * y, Row(src, src_pitch, y), w, m_thresh);
+    }
+    settle_kernels[m_length](plane, words, w, h, m, mask_pitch, coords_accessor.ptr);
+    ApplyMask(dst, apply, m, w, h, apply_pitch, dst_pitch, mask_pitch);
+    bits.Release(bits_accessor);
+    mask.Release(mask_accessor);
+    coords.Release(coords_accessor);
+}
+
+// Approximate cleaning for previews. The mask is reduced by m_fast in both directions and its
+// components are found on the blocks, sized by the pixels they hold and compared against the full
+// length. Every pixel above thresh then follows the decision of its block. Pieces sharing a block
+// are merged, so a few small components close to others survive, while everything the exact
+// path keeps is kept.
+template <class T>
+void MaskCleaner::ClearMaskReduced(T *dst, const T *src, const T *apply, ptrdiff_t src_pitch, ptrdiff_t apply_pitch, ptrdiff_t dst_pitch) {
+    int w = m_w;
+    int h = m_h;
+    int f = m_fast;
+    int rw = (w + f - 1) / f;
+    int rh = (h + f - 1) / f;
+    Array<uint16_t> occupancy_accessor = occupancy.Acquire();
+    Array<int> parents_accessor = blocks.Acquire();
+    Array<int> sums_accessor = blocks.Acquire();
+    Array<uint8_t> keep_accessor = kept.Acquire();
+    Array<uint8_t> mask_accessor = mask.Acquire();
+    uint16_t* occ = occupancy_accessor.ptr;
+    uint8_t* keep = keep_accessor.ptr;
+    uint8_t* m = mask_accessor.ptr;
+    for(int y = 0; y < rh; y++){
+        if (f == 2) {
+            ReduceRow<2>(occ + rw * y, Row(src, src_pitch, y * f), src_pitch, std::min(f, h - y * f), w, m_thresh);
+        } else {
+            ReduceRow<4>(occ + rw * y, Row(src, src_pitch, y * f), src_pitch, std::min(f, h - y * f), w, m_thresh);
+        }
+    }
+    if (f == 2) {
+        KeepBlocks<2>(keep, occ, parents_accessor.ptr, sums_accessor.ptr, rw, rh, m_length);
+    } else {
+        KeepBlocks<4>(keep, occ, parents_accessor.ptr, sums_accessor.ptr, rw, rh, m_length);
+    }
+    // expanded one row at a time, so the full size mask never leaves the cache
+    SelectOp op;
+    for(int y = 0; y < h; y++){
+        ExpandRow(m, Row(src, src_pitch, y), keep + rw * (y / f), w, f, m_thresh);
+        ApplyRow(dst, apply, m, w, op);
+        dst = Row(dst, dst_pitch, 1);
+        apply = Row(apply, apply_pitch, 1);
+    }
+    occupancy.Release(occupancy_accessor);
+    blocks.Release(parents_accessor);
+    blocks.Release(sums_accessor);
+    kept.Release(keep_accessor);
+    mask.Release(mask_accessor);
+}
+
+// Components are built from horizontal runs merged with union-find. Runs whose pixels are at most
+// m_radius apart are merged, so with a radius above 1 nearby fragments count as one component
+// while only their own pixels get labeled.
+template <class T>
+void MaskCleaner::LabelComponents(int *lab, std::vector<int>& sizes, const T *src, ptrdiff_t src_pitch) {
+    int w = m_w;
+    int h = m_h;
+    Array<Run> runs_accessor = runs.Acquire();
+    Array<int> parents_accessor = parents.Acquire();
+    Run* run = runs_accessor.ptr;
+    int* parent = parents_accessor.ptr;
+    std::vector<int> rows(h + 1);
+    int r = m_radius;
+    int n = 0;
+    for(int y = 0; y < h; ++y) {
+        rows[y] = n;
+        const T* s = Row(src, src_pitch, y);
+        for(int x = 0; x < w;) {
+            if (s[x] <= m_thresh) {
+                ++x;
+                continue;
+            }
+            run[n].x0 = x;
+            while (x < w && s[x] > m_thresh) {
+                ++x;
+            }
+            run[n].x1 = x;
+            parent[n] = n;
+            if (n > rows[y] && run[n].x0 - run[n - 1].x1 < r) {
+                Union(parent, n - 1, n);
+            }
+            ++n;
+        }
+        for (int j = std::max(0, y - r); j < y; ++j) {
+            int i = rows[j];
+            int k = rows[y];
+            while (i < rows[j + 1] && k < n) {
+                if (run[i].x1 + r <= run[k].x0) {
+                    ++i;
+                } else if (run[k].x1 + r <= run[i].x0) {
+                    ++k;
+                } else {
+                    Union(parent, i, k);
+                    if (run[i].x1 < run[k].x1) ++i; else ++k;
+                }
+            }
+        }
+    }
+    rows[h] = n;
+
+    // roots are always the first run of their component, so a single pass in scan order numbers
+    // the components and turns every parent into the negated label
+    memset(lab,0,w*h*sizeof(int));
+    sizes.assign(1,0);
+    for(int y = 0; y < h; ++y) {
+        for(int i = rows[y]; i < rows[y + 1]; ++i) {
+            if (parent[i] == i) {
+                parent[i] = -(int)sizes.size();
+                sizes.push_back(0);
+            } else {
+                parent[i] = parent[parent[i]];
+            }
+            int id = -parent[i];
+            sizes[id] += run[i].x1 - run[i].x0;
+            std::fill(lab + w * y + run[i].x0, lab + w * y + run[i].x1, id);
+        }
+    }
+    runs.Release(runs_accessor);
+    parents.Release(parents_accessor);
+}
+
+void MaskCleaner::WriteComponents(uint8_t *dst, const int *lab, const std::vector<int>& sizes, int mode, ptrdiff_t dst_pitch) {
+    int w = m_w;
+    int h = m_h;
+    // stacked 16 bit output keeps the MSB in the upper half and the LSB in the lower half
+    uint8_t* lsb = dst + h * dst_pitch;
+    for(int y = 0; y < h; y++){
+        for(int x = 0; x < w; x++){
+            int l = lab[w * y + x];
+            int v;
+            switch (mode) {
+            case MODE_SIZE:
+                dst[x] = std::min(sizes[l], 255);
+                continue;
+            case MODE_SIZE16:
+                v = std::min(sizes[l], 65535);
+                break;
+            default:
+                // labels past 65535 wrap around, skipping 0 which is reserved for the background
+                v = l == 0 ? 0 : (l - 1) % 65535 + 1;
+                break;
+            }
+            dst[x] = v >> 8;
+            lsb[x] = v & 0xFF;
+        }
+        dst += dst_pitch;
+        lsb += dst_pitch;
+    }
+}
+
+template <class T>
+void MaskCleaner::ClearMaskSweep(T *dst, const int *lab, const std::vector<int>& sizes, const T *apply, ptrdiff_t apply_pitch, ptrdiff_t dst_pitch) {
+    int w = m_w;
+    int h = m_h;
+    Array<uint8_t> mask_accessor = mask.Acquire();
+    uint8_t* rank = mask_accessor.ptr;
+
+    // rank is the number of lengths a component reaches, so each output only needs one compare per pixel
+    std::vector<uint8_t> component_rank(sizes.size(), 0);
+    for (size_t i = 1; i < sizes.size(); i++) {
+        component_rank[i] = std::upper_bound(m_sorted_lengths.begin(), m_sorted_lengths.end(), sizes[i]) - m_sorted_lengths.begin();
+    }
+    int rank_pitch = (w + 15) & ~15;
+    for(int y = 0; y < h; y++){
+        for(int x = 0; x < w; x++){
+            rank[rank_pitch * y + x] = component_rank[lab[w * y + x]];
+        }
+    }
+
+    for(size_t k = 0; k < m_lengths.size(); k++){
+        int level = std::lower_bound(m_sorted_lengths.begin(), m_sorted_lengths.end(), m_lengths[k]) - m_sorted_lengths.begin();
+        RankOp op(level);
+        T* d = Row(dst, dst_pitch, k * h);
+        const T* a = apply;
+        const uint8_t* r = rank;
+        for(int y = 0; y < h; y++){
+            ApplyRow(d, a, r, w, op);
+            d = Row(d, dst_pitch, 1);
+            a = Row(a, apply_pitch, 1);
+            r += rank_pitch;
+        }
+    }
+    mask.Release(mask_accessor);
+}
+
+template void MaskCleaner::Clean<uint8_t>(uint8_t*, const uint8_t*, const uint8_t*, ptrdiff_t, ptrdiff_t, ptrdiff_t, std::vector<int>*);
+template void MaskCleaner::Clean<uint16_t>(uint16_t*, const uint16_t*, const uint16_t*, ptrdiff_t, ptrdiff_t, ptrdiff_t, std::vector<int>*);
+template PComponents MaskCleaner::Label<uint8_t>(const uint8_t*, ptrdiff_t, bool);
+template PComponents MaskCleaner::Label<uint16_t>(const uint16_t*, ptrdiff_t, bool);
+template void MaskCleaner::ClearMaskSweep<uint8_t>(uint8_t*, const int*, const std::vector<int>&, const uint8_t*, ptrdiff_t, ptrdiff_t);
+template void MaskCleaner::ClearMaskSweep<uint16_t>(uint16_t*, const int*, const std::vector<int>&, const uint16_t*, ptrdiff_t, ptrdiff_t);
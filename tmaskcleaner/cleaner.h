@@ -0,0 +1,224 @@
+#pragma once
+// Mask cleaning core shared by the AviSynth filter and the Python module. It doesn't depend on
+// AviSynth, frames are passed as plain pointers with pitches in bytes.
+#include <vector>
+#include <stack>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <new>
+#include <cstddef>
+#include <cstdint>
+
+typedef std::pair<int, int> Coordinates;
+
+struct Run {
+    int x0;
+    int x1;
+};
+
+enum OutputMode {
+    MODE_CLEAN,   // cleaned mask
+    MODE_SIZE,    // component size, saturated to 255
+    MODE_SIZE16,  // component size as stacked 16 bit, saturated to 65535
+    MODE_LABEL16  // component label as stacked 16 bit
+};
+
+// Counters of the strategies the scratch allocator actually used.
+struct AllocStats {
+    std::atomic<unsigned int> heap;
+    std::atomic<unsigned int> large_pages;
+    std::atomic<unsigned int> transparent_pages;
+    std::atomic<unsigned int> regular_pages;
+    std::atomic<unsigned int> numa_local;
+    // set once on Windows if large pages were asked for but SeLockMemoryPrivilege couldn't be enabled
+    std::atomic<unsigned int> no_privilege;
+};
+
+AllocStats& Stats();
+
+enum AllocKind {
+    ALLOC_HEAP,
+    ALLOC_PAGES
+};
+
+int CurrentNode();
+void* Allocate(size_t& bytes, int node, bool huge, AllocKind& kind);
+void Deallocate(void* p, size_t bytes, AllocKind kind);
+
+// Scratch array of trivial elements, left uninitialized.
+template <class T>
+class Array {
+public:
+    T* ptr;
+    int node;
+
+    Array(int size, bool huge = false):
+        node(CurrentNode()),
+        bytes(size_t(size) * sizeof(T))
+    {
+        ptr = static_cast<T*>(Allocate(bytes, node, huge, kind));
+        if (ptr == nullptr) {
+            throw std::bad_alloc();
+        }
+    }
+
+    Array():
+        ptr(nullptr),
+        node(0),
+        bytes(0),
+        kind(ALLOC_HEAP)
+    {};
+
+    ~Array(){
+        if(ptr!=nullptr) Deallocate(ptr, bytes, kind);
+    }
+
+    Array(Array<T>&& a):
+        ptr(a.ptr),
+        node(a.node),
+        bytes(a.bytes),
+        kind(a.kind)
+    {
+        a.ptr = nullptr;
+    }
+
+    Array<T>& operator=(Array<T>&& a){
+        if(ptr!=nullptr && ptr!=a.ptr) Deallocate(ptr, bytes, kind);
+        ptr = a.ptr;
+        node = a.node;
+        bytes = a.bytes;
+        kind = a.kind;
+        a.ptr = nullptr;
+        return *this;
+    }
+
+    // Size of the allocation, which may be rounded up to whole large pages.
+    size_t Bytes() const { return bytes; }
+
+private:
+    size_t bytes;
+    AllocKind kind;
+};
+
+// Pool of scratch arrays, kept per NUMA node so a thread gets back memory local to it.
+template <class T>
+class DynamicBuffer {
+private:
+    mutable std::mutex m;
+    int size;
+    bool huge;
+    std::map<int, std::stack<Array<T>>> stacks;
+public:
+    DynamicBuffer(int size_, bool huge_ = false):
+        size(size_),
+        huge(huge_)
+    {};
+
+    Array<T> Acquire(){
+        int node = CurrentNode();
+        {
+            std::lock_guard<std::mutex> lock(m);
+            std::stack<Array<T>>& stack = stacks[node];
+            if(!stack.empty()){
+                Array<T> a = std::move(stack.top());
+                stack.pop();
+                return a;
+            }
+        }
+        return Array<T>(size, huge);
+    }
+
+    void Release(Array<T>& v){
+        std::lock_guard<std::mutex> lock(m);
+        stacks[v.node].push(std::move(v));
+    }
+};
+
+// Result of labeling a single frame. labels uses a pitch of the frame width, 0 marks
+// pixels below thresh, sizes[0] is unused.
+struct Components {
+    Array<int> labels;
+    std::vector<int> sizes;
+};
+
+typedef std::shared_ptr<const Components> PComponents;
+
+inline int FindRoot(int* parent, int i) {
+    while (parent[i] != i) {
+        parent[i] = parent[parent[i]];
+        i = parent[i];
+    }
+    return i;
+}
+
+// Links the root with the higher index to the lower one, so every parent points backwards.
+inline void Union(int* parent, int a, int b) {
+    a = FindRoot(parent, a);
+    b = FindRoot(parent, b);
+    if (a < b) {
+        parent[b] = a;
+    } else {
+        parent[a] = b;
+    }
+}
+
+// Finds the components of frames of a fixed size and applies them. Pixel types are uint8_t and
+// uint16_t, all methods may be called from several threads at once.
+class MaskCleaner {
+public:
+    // lengths lists the outputs of ClearMaskSweep, if it is empty there is a single one for length.
+    // A fast factor of 2 or 4 makes Clean find components on blocks of that size, it only applies
+    // to a radius of 1.
+    MaskCleaner(int width, int height, int length, int thresh, int radius, const std::vector<int>& lengths, bool hugepages, int fast);
+
+    // dst gets apply where the component of src reaches length and 0 elsewhere. If sizes is given
+    // it receives the sizes of all components, which are always exact.
+    template <class T>
+    void Clean(T *dst, const T *src, const T *apply, ptrdiff_t src_pitch, ptrdiff_t apply_pitch, ptrdiff_t dst_pitch, std::vector<int>* sizes = nullptr);
+
+    // Labels src into buffers taken from the pool, or freshly allocated ones if the result is kept around.
+    template <class T>
+    PComponents Label(const T *src, ptrdiff_t src_pitch, bool pooled = true);
+
+    // Writes one output per length, stacked vertically.
+    template <class T>
+    void ClearMaskSweep(T *dst, const int *lab, const std::vector<int>& sizes, const T *apply, ptrdiff_t apply_pitch, ptrdiff_t dst_pitch);
+
+    void WriteComponents(uint8_t *dst, const int *lab, const std::vector<int>& sizes, int mode, ptrdiff_t dst_pitch);
+
+    int Width() const { return m_w; }
+    int Height() const { return m_h; }
+    int Radius() const { return m_radius; }
+
+private:
+    unsigned int m_length;
+    unsigned int m_thresh;
+    int m_radius;
+    bool m_hugepages;
+    std::vector<int> m_lengths;
+    std::vector<int> m_sorted_lengths;
+    int m_w;
+    int m_h;
+    int m_fast;
+    DynamicBuffer<int> buffer;
+    DynamicBuffer<int> labels;
+    DynamicBuffer<uint8_t> mask;
+    DynamicBuffer<Coordinates> coords;
+    DynamicBuffer<Run> runs;
+    DynamicBuffer<int> parents;
+    DynamicBuffer<uint64_t> bits;
+    DynamicBuffer<uint16_t> occupancy;
+    DynamicBuffer<int> blocks;
+    DynamicBuffer<uint8_t> kept;
+
+    template <class T>
+    void ClearMask(T *dst, const T *src, const T *apply, ptrdiff_t src_pitch, ptrdiff_t apply_pitch, ptrdiff_t dst_pitch);
+    template <class T>
+    void ClearMaskSmall(T *dst, const T *src, const T *apply, ptrdiff_t src_pitch, ptrdiff_t apply_pitch, ptrdiff_t dst_pitch);
+    template <class T>
+    void ClearMaskReduced(T *dst, const T *src, const T *apply, ptrdiff_t src_pitch, ptrdiff_t apply_pitch, ptrdiff_t dst_pitch);
+    template <class T>
+    void LabelComponents(int *lab, std::vector<int>& sizes, const T *src, ptrdiff_t src_pitch);
+};
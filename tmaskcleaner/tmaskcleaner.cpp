@@ -1,76 +1,128 @@
+#define NOMINMAX
 #include <Windows.h>
 #include <vector>
-#include <stack>
 #include <memory>
+#include <algorithm>
+#include <cstdlib>
+#include <cstdio>
+#include <list>
+#include <map>
 #pragma warning(disable: 4512 4244 4100)
 #include "avisynth.h"
 #pragma warning(default: 4512 4244 4100)
 #include <mutex>
-#include <emmintrin.h>
-
-typedef std::pair<int, int> Coordinates;
+#include "cleaner.h"
 
 namespace {
 
-    template <class T>
-    class ArrayAccessor;
+    // Pairs of labels of two consecutive frames whose pixels touch in (x, y, t).
+    typedef std::vector<std::pair<int, int>> Links;
+    typedef std::shared_ptr<const Links> PLinks;
 
-    template <class T>
-    class Array {
+    // Process-wide LRU of labeled frames, so instances working on the same clip only label each frame once.
+    class ComponentCache {
     public:
-        T* ptr;
-
-        Array(int size)
-        {
-            ptr = new T[size];
-        }
+        struct Key {
+            const IClip* clip;
+            int frame;
+            int thresh;
+            int radius;
 
-        Array():
-            ptr(nullptr)
-        {};
+            bool operator<(const Key& k) const {
+                if (clip != k.clip) return clip < k.clip;
+                if (frame != k.frame) return frame < k.frame;
+                if (thresh != k.thresh) return thresh < k.thresh;
+                return radius < k.radius;
+            }
+        };
 
-        ~Array(){
-            if(ptr!=nullptr) delete [] ptr;
+        static ComponentCache& Instance() {
+            static ComponentCache cache;
+            return cache;
         }
 
-        Array(Array<T>&& a):
-            ptr(a.ptr)
-        {
-            a.ptr = nullptr;
+        PComponents Find(const Key& key) {
+            std::lock_guard<std::mutex> lock(m);
+            auto it = index.find(key);
+            if (it == index.end()) {
+                ++misses;
+                return PComponents();
+            }
+            ++hits;
+            lru.splice(lru.begin(), lru, it->second);
+            return it->second->value;
         }
 
-        Array<T>& operator=(Array<T>&& a){
-            ptr = a.ptr;
-            a.ptr = nullptr;
-            return *this;
+        void Insert(const Key& key, const PComponents& value, size_t bytes) {
+            std::lock_guard<std::mutex> lock(m);
+            if (index.count(key) != 0 || bytes > budget) {
+                return;
+            }
+            lru.push_front(Entry(key, value, bytes));
+            index[key] = lru.begin();
+            used += bytes;
+            while (used > budget) {
+                Evict(--lru.end());
+                ++evictions;
+            }
         }
-    };
 
-    template <class T>
-    class DynamicBuffer {
-    private:
-        mutable std::mutex m;
-        int size;
-        std::stack<Array<T>> stack;
-    public:
-        DynamicBuffer(int size_):
-            size(size_)
-        {};
+        // Entries are keyed by the clip pointer, so they must be dropped before the clip can go away
+        // and its address be reused.
+        void Register(const IClip* clip, size_t budget_) {
+            std::lock_guard<std::mutex> lock(m);
+            ++clips[clip];
+            budget = std::max(budget, budget_);
+        }
 
-        Array<T> Acquire(){
+        void Unregister(const IClip* clip) {
             std::lock_guard<std::mutex> lock(m);
-            if(!stack.empty()){
-                Array<T> a = std::move(stack.top());
-                stack.pop();
-                return a;
-            } else {
-                return Array<T>(size);
+            if (--clips[clip] > 0) {
+                return;
+            }
+            clips.erase(clip);
+            for (auto it = lru.begin(); it != lru.end();) {
+                auto next = std::next(it);
+                if (it->key.clip == clip) {
+                    Evict(it);
+                }
+                it = next;
             }
         }
 
-        void Release(Array<T>& v){
+        void Stats(char* buf, size_t size) {
             std::lock_guard<std::mutex> lock(m);
-            stack.push(std::move(v));
+            _snprintf(buf, size, "hits=%u misses=%u evictions=%u entries=%u bytes=%u", hits, misses, evictions, (unsigned)lru.size(), (unsigned)used);
+            buf[size - 1] = 0;
+        }
+
+    private:
+        struct Entry {
+            Key key;
+            PComponents value;
+            size_t bytes;
+
+            Entry(const Key& k, const PComponents& v, size_t b): key(k), value(v), bytes(b) {}
+        };
+
+        std::mutex m;
+        std::list<Entry> lru;
+        std::map<Key, std::list<Entry>::iterator> index;
+        std::map<const IClip*, int> clips;
+        size_t used;
+        size_t budget;
+        unsigned int hits;
+        unsigned int misses;
+        unsigned int evictions;
+
+        ComponentCache():
+            used(0), budget(0), hits(0), misses(0), evictions(0)
+        {};
+
+        void Evict(std::list<Entry>::iterator it) {
+            used -= it->bytes;
+            index.erase(it->key);
+            lru.erase(it);
         }
     };
 }
@@ -78,29 +130,45 @@ namespace {
 
 class TMaskCleaner : public GenericVideoFilter {
 public:
-    TMaskCleaner(PClip child, int length, int thresh, IScriptEnvironment*);
+    TMaskCleaner(PClip child, int length, int thresh, PClip apply, int mode, const char* lengths, int cache, int temporal, int radius, bool hugepages, int fast, IScriptEnvironment*);
     PVideoFrame __stdcall GetFrame(int n, IScriptEnvironment* env);
 
-    ~TMaskCleaner() {}
+    ~TMaskCleaner() {
+        if (m_cache) {
+            ComponentCache::Instance().Unregister(child.operator->());
+        }
+    }
 private:
-    unsigned int m_length;
     unsigned int m_thresh;
-    DynamicBuffer<int> buffer;
-    DynamicBuffer<BYTE> mask;
-    DynamicBuffer<Coordinates> coords;
+    PClip m_apply;
+    int m_mode;
+    std::vector<int> m_lengths;
+    bool m_components;
+    bool m_cache;
+    int m_temporal;
+    int m_radius;
+    std::unique_ptr<MaskCleaner> m_cleaner;
+    // declared after the cleaner, uncached slices release their labels into its buffers
+    std::mutex m_window_lock;
+    std::map<int, PComponents> m_slices;
+    std::map<int, PLinks> m_links;
     int m_w;
-    int size;
+    int m_h;
 
-    void ClearMask(BYTE *dst, const BYTE *src, int width, int height, int src_pitch, int dst_pitch);
+    PComponents FindComponents(int n, const BYTE *src, int src_pitch);
+    PComponents FindSlice(int n, IScriptEnvironment* env);
+    PLinks FindLinks(int n, const Components& a, const Components& b);
+    void TemporalSizes(std::vector<int>& sizes, int n, const PComponents& center, IScriptEnvironment* env);
 };
 
-TMaskCleaner::TMaskCleaner(PClip child, int length, int thresh, IScriptEnvironment* env) :
+TMaskCleaner::TMaskCleaner(PClip child, int length, int thresh, PClip apply, int mode, const char* lengths, int cache, int temporal, int radius, bool hugepages, int fast, IScriptEnvironment* env) :
     GenericVideoFilter(child),
-    m_length(length),
     m_thresh(thresh),
-    buffer(length),
-    mask(child->GetVideoInfo().height * (child->GetVideoInfo().width +16)),
-    coords(child->GetVideoInfo().height * child->GetVideoInfo().width)
+    m_apply(apply),
+    m_mode(mode),
+    m_cache(false),
+    m_temporal(temporal),
+    m_radius(radius)
 {
     if (!child->GetVideoInfo().IsYV12()) {
         env->ThrowError("Only YV12 and YV24 is supported!");
@@ -108,6 +176,60 @@ TMaskCleaner::TMaskCleaner(PClip child, int length, int thresh, IScriptEnvironme
     if (length <= 0 || thresh <= 0) {
         env->ThrowError("Invalid arguments!");
     }
+    if (apply) {
+        const VideoInfo& avi = apply->GetVideoInfo();
+        if (!avi.IsYV12() || avi.width != vi.width || avi.height != vi.height) {
+            env->ThrowError("Apply clip must be YV12 of the same size!");
+        }
+    }
+    if (mode < MODE_CLEAN || mode > MODE_LABEL16) {
+        env->ThrowError("Invalid mode!");
+    }
+    if (mode != MODE_CLEAN && apply) {
+        env->ThrowError("Apply clip can only be used with mode=0!");
+    }
+    if (mode == MODE_SIZE16 || mode == MODE_LABEL16) {
+        vi.height *= 2;
+    }
+    if (lengths != nullptr) {
+        const char* p = lengths;
+        while (*p) {
+            char* end;
+            long l = strtol(p, &end, 10);
+            if (end == p || l <= 0) {
+                env->ThrowError("Invalid lengths!");
+            }
+            m_lengths.push_back(l);
+            p = end;
+            while (*p == ',' || *p == ' ') {
+                ++p;
+            }
+        }
+        if (m_lengths.empty() || m_lengths.size() > 127) {
+            env->ThrowError("Lengths must list between 1 and 127 values!");
+        }
+        if (mode != MODE_CLEAN) {
+            env->ThrowError("Lengths can only be used with mode=0!");
+        }
+        vi.height *= m_lengths.size();
+    }
+    if (cache < 0) {
+        env->ThrowError("Invalid cache size!");
+    }
+    if (temporal < 0) {
+        env->ThrowError("Invalid temporal radius!");
+    }
+    if (radius < 1) {
+        env->ThrowError("Invalid radius!");
+    }
+    // cached, temporal and gap tolerant components are applied through the sweep path with a single length
+    m_components = mode != MODE_CLEAN || !m_lengths.empty() || cache > 0 || temporal > 0 || radius > 1;
+    if (fast != 0 && fast != 2 && fast != 4) {
+        env->ThrowError("Fast must be 0, 2 or 4!");
+    }
+    if (fast != 0 && m_components) {
+        env->ThrowError("Fast can't be combined with mode, lengths, cache, temporal or radius!");
+    }
     int CPUInfo[4]; //eax, ebx, ecx, edx
     __cpuid(CPUInfo, 1);
 
@@ -115,110 +237,191 @@ TMaskCleaner::TMaskCleaner(PClip child, int length, int thresh, IScriptEnvironme
         env->ThrowError("Sorry, SSSE3 is required");
     }
     m_w = child->GetVideoInfo().width;
+    m_h = child->GetVideoInfo().height;
+    m_cleaner.reset(new MaskCleaner(m_w, m_h, length, thresh, radius, m_lengths, hugepages, fast));
+    // last, the destructor that unregisters doesn't run if the constructor throws
+    if (cache > 0) {
+        m_cache = true;
+        ComponentCache::Instance().Register(child.operator->(), size_t(cache) << 20);
+    }
 }
 
 PVideoFrame TMaskCleaner::GetFrame(int n, IScriptEnvironment* env) {
     PVideoFrame src = child->GetFrame(n,env);
-    PVideoFrame dst = env->NewVideoFrame(child->GetVideoInfo());
+    PVideoFrame dst = env->NewVideoFrame(vi);
+
+    PVideoFrame apply = m_apply ? m_apply->GetFrame(n,env) : src;
 
-    ClearMask(dst->GetWritePtr(PLANAR_Y), src->GetReadPtr(PLANAR_Y), dst->GetRowSize(PLANAR_Y), dst->GetHeight(PLANAR_Y),src->GetPitch(PLANAR_Y), dst->GetPitch(PLANAR_Y));
+    if (m_components) {
+        PComponents c;
+        std::vector<int> temporal_sizes;
+        if (m_temporal > 0) {
+            c = FindSlice(n, env);
+            TemporalSizes(temporal_sizes, n, c, env);
+        } else {
+            c = FindComponents(n, src->GetReadPtr(PLANAR_Y), src->GetPitch(PLANAR_Y));
+        }
+        const std::vector<int>& sizes = m_temporal > 0 ? temporal_sizes : c->sizes;
+        if (m_mode != MODE_CLEAN) {
+            m_cleaner->WriteComponents(dst->GetWritePtr(PLANAR_Y), c->labels.ptr, sizes, m_mode, dst->GetPitch(PLANAR_Y));
+        } else {
+            m_cleaner->ClearMaskSweep(dst->GetWritePtr(PLANAR_Y), c->labels.ptr, sizes, apply->GetReadPtr(PLANAR_Y), apply->GetPitch(PLANAR_Y), dst->GetPitch(PLANAR_Y));
+        }
+        return dst;
+    }
+
+    m_cleaner->Clean(dst->GetWritePtr(PLANAR_Y), src->GetReadPtr(PLANAR_Y), apply->GetReadPtr(PLANAR_Y), src->GetPitch(PLANAR_Y), apply->GetPitch(PLANAR_Y), dst->GetPitch(PLANAR_Y));
     return dst;
 }
 
-void TMaskCleaner::ClearMask(BYTE *dst, const BYTE *src, int w, int h, int src_pitch, int dst_pitch) {
-    Array<int> buffer_accessor = buffer.Acquire();
-    Array<BYTE> mask_accessor = mask.Acquire();
-    Array<Coordinates> coords_accessor = coords.Acquire();
-    int* buf = buffer_accessor.ptr;
-    BYTE* m = mask_accessor.ptr;
-    Coordinates* coordinates = coords_accessor.ptr;
-    memset(m,1,h*src_pitch);
-    int b,cs;
-    Coordinates current;
-    for(int y = 0; y < h; ++y) {
-        for(int x = 0; x < w; ++x) {
-            int pos = src_pitch * y + x;
-            if (m[pos]!=1) {
-                continue;
-            }
-            m[pos]=0;
-            if(src[pos]<=m_thresh) {
+PComponents TMaskCleaner::FindComponents(int n, const BYTE *src, int src_pitch) {
+    if (!m_cache) {
+        return m_cleaner->Label(src, src_pitch);
+    }
+
+    ComponentCache& cache = ComponentCache::Instance();
+    ComponentCache::Key key = { child.operator->(), n, (int)m_thresh, m_radius };
+    PComponents found = cache.Find(key);
+    if (found) {
+        return found;
+    }
+    PComponents c = m_cleaner->Label(src, src_pitch, false);
+    // charged what was mapped, large pages round the labels up to whole pages
+    cache.Insert(key, c, c->labels.Bytes() + c->sizes.capacity() * sizeof(int));
+    return c;
+}
+
+PComponents TMaskCleaner::FindSlice(int n, IScriptEnvironment* env) {
+    {
+        std::lock_guard<std::mutex> lock(m_window_lock);
+        auto it = m_slices.find(n);
+        if (it != m_slices.end()) {
+            return it->second;
+        }
+    }
+    PVideoFrame src = child->GetFrame(n,env);
+    PComponents c = FindComponents(n, src->GetReadPtr(PLANAR_Y), src->GetPitch(PLANAR_Y));
+    std::lock_guard<std::mutex> lock(m_window_lock);
+    m_slices[n] = c;
+    return c;
+}
+
+PLinks TMaskCleaner::FindLinks(int n, const Components& a, const Components& b) {
+    {
+        std::lock_guard<std::mutex> lock(m_window_lock);
+        auto it = m_links.find(n);
+        if (it != m_links.end()) {
+            return it->second;
+        }
+    }
+    std::shared_ptr<Links> links = std::make_shared<Links>();
+    const int* la = a.labels.ptr;
+    const int* lb = b.labels.ptr;
+    // neighbouring frames connect within the same radius as pixels of one frame
+    for(int y = 0; y < m_h; ++y) {
+        int y_min = std::max(0, y - m_radius);
+        int y_max = std::min(m_h, y + m_radius + 1);
+        for(int x = 0; x < m_w; ++x) {
+            int l = la[m_w * y + x];
+            if (l == 0) {
                 continue;
             }
-            buf[0]=pos;
-            b=1;
-            coordinates[0] = Coordinates(x,y);
-            cs = 1;
-            while(cs>0){
-                current = coordinates[--cs];
-                int x_min = current.first  == 0 ? 0 : current.first - 1;
-                int x_max = current.first  == w - 1 ? w : current.first + 2;
-                int y_min = current.second == 0 ? 0 : current.second - 1;
-                int y_max = current.second == h - 1 ? h : current.second + 2;
-                for (int j = y_min; j < y_max; ++j ) {
-                    for (int i = x_min; i < x_max; ++i ) {
-                        pos = src_pitch * j + i;
-                        if (m[pos]==1){
-                            m[pos]=0;
-                            if(src[pos]>m_thresh){
-                                coordinates[cs++] = Coordinates(i,j);
-                                if(b<m_length){
-                                    buf[b++] = pos;
-                                } else {
-                                    m[pos] = 0xFF;
-                                }
-                            }
-
-                        }
+            int x_min = std::max(0, x - m_radius);
+            int x_max = std::min(m_w, x + m_radius + 1);
+            for (int j = y_min; j < y_max; ++j ) {
+                for (int i = x_min; i < x_max; ++i ) {
+                    int r = lb[m_w * j + i];
+                    if (r != 0 && (links->empty() || links->back() != std::make_pair(l, r))) {
+                        links->push_back(std::make_pair(l, r));
                     }
                 }
             }
-            if(b>=m_length){
-                for(int i = 0;i<m_length;i++){
-                    m[buf[i]] = 0xFF;
-                }
-            }
         }
     }
+    std::sort(links->begin(), links->end());
+    links->erase(std::unique(links->begin(), links->end()), links->end());
+    std::lock_guard<std::mutex> lock(m_window_lock);
+    m_links[n] = links;
+    return links;
+}
+
+// Slices and links between neighbouring slices are kept while they stay inside the window, so moving
+// to the next frame only labels and links the new slice. Merging them is a union-find over component
+// ids, which is tiny compared to the frames.
+void TMaskCleaner::TemporalSizes(std::vector<int>& sizes, int n, const PComponents& center, IScriptEnvironment* env) {
+    int first = std::max(0, n - m_temporal);
+    int last = std::min(vi.num_frames - 1, n + m_temporal);
+    std::vector<PComponents> slices;
+    std::vector<int> offsets;
+    int total = 0;
+    for (int t = first; t <= last; t++) {
+        slices.push_back(t == n ? center : FindSlice(t, env));
+        offsets.push_back(total);
+        total += slices.back()->sizes.size();
+    }
 
-    int m16 = w / 16;
-    int mw = m16*16;
-    int sov = src_pitch - w;
-    int dov = dst_pitch - w;
-    for(int y = 0,sp =0 ,dp =0; y < h; y++){
-        for(int x=0; x < m16; x++){
-            __m128i a = _mm_load_si128(reinterpret_cast<const __m128i*>(src+sp));
-            __m128i b = _mm_load_si128(reinterpret_cast<const __m128i*>(m+sp));
-            _mm_store_si128(reinterpret_cast<__m128i*>(dst+dp), _mm_and_si128(a,b));
-            sp+=16;
-            dp+=16;
-        }
-        sp+=sov;
-        dp+=dov;
-    }
-    if(w>mw){
-        for(int y=0,sp=0,dp=0;y<h;y++){
-            sp += mw;
-            dp += mw;
-            for(int x=mw;x<w;x++,sp++,dp++){
-                dst[dp] = src[sp] & m[sp];
+    std::vector<int> parent(total);
+    std::vector<int> volume(total);
+    for (size_t k = 0; k < slices.size(); k++) {
+        const std::vector<int>& s = slices[k]->sizes;
+        for (size_t l = 0; l < s.size(); l++) {
+            parent[offsets[k] + l] = offsets[k] + l;
+            volume[offsets[k] + l] = s[l];
+        }
+    }
+    for (size_t k = 0; k + 1 < slices.size(); k++) {
+        PLinks links = FindLinks(first + k, *slices[k], *slices[k + 1]);
+        for (auto it = links->begin(); it != links->end(); ++it) {
+            int a = FindRoot(parent.data(), offsets[k] + it->first);
+            int b = FindRoot(parent.data(), offsets[k + 1] + it->second);
+            if (a != b) {
+                parent[b] = a;
+                volume[a] += volume[b];
             }
-            sp+= sov;
-            dp+= dov;
         }
     }
-    buffer.Release(buffer_accessor);
-    mask.Release(mask_accessor);
-    coords.Release(coords_accessor);
+
+    int k = n - first;
+    sizes.assign(center->sizes.size(), 0);
+    for (size_t l = 1; l < sizes.size(); l++) {
+        sizes[l] = volume[FindRoot(parent.data(), offsets[k] + l)];
+    }
+
+    std::lock_guard<std::mutex> lock(m_window_lock);
+    for (auto it = m_slices.begin(); it != m_slices.end();) {
+        it = std::abs(it->first - n) > m_temporal + 1 ? m_slices.erase(it) : std::next(it);
+    }
+    for (auto it = m_links.begin(); it != m_links.end();) {
+        it = std::abs(it->first - n) > m_temporal + 1 ? m_links.erase(it) : std::next(it);
+    }
 }
 
 AVSValue __cdecl Create_TMaskCleaner(AVSValue args, void*, IScriptEnvironment* env)
 {
-    enum { CLIP, LENGTH, THRESH};
-    return new TMaskCleaner(args[CLIP].AsClip(), args[LENGTH].AsInt(5), args[THRESH].AsInt(235), env);
+    enum { CLIP, LENGTH, THRESH, APPLY, MODE, LENGTHS, CACHE, TEMPORAL, RADIUS, HUGEPAGES, FAST};
+    return new TMaskCleaner(args[CLIP].AsClip(), args[LENGTH].AsInt(5), args[THRESH].AsInt(235), args[APPLY].Defined() ? args[APPLY].AsClip() : 0, args[MODE].AsInt(MODE_CLEAN), args[LENGTHS].AsString(nullptr), args[CACHE].AsInt(0), args[TEMPORAL].AsInt(0), args[RADIUS].AsInt(1), args[HUGEPAGES].AsBool(false), args[FAST].AsInt(0), env);
+}
+
+AVSValue __cdecl Create_TMaskCleanerCacheStats(AVSValue, void*, IScriptEnvironment* env)
+{
+    char stats[256];
+    ComponentCache::Instance().Stats(stats, sizeof(stats));
+    return env->SaveString(stats);
+}
+
+AVSValue __cdecl Create_TMaskCleanerAllocStats(AVSValue, void*, IScriptEnvironment* env)
+{
+    char stats[256];
+    AllocStats& s = Stats();
+    _snprintf(stats, sizeof(stats), "heap=%u large=%u transparent=%u regular=%u numa=%u noprivilege=%u",
+        s.heap.load(), s.large_pages.load(), s.transparent_pages.load(), s.regular_pages.load(), s.numa_local.load(), s.no_privilege.load());
+    stats[sizeof(stats) - 1] = 0;
+    return env->SaveString(stats);
 }
 
 extern "C" __declspec(dllexport) const char* __stdcall AvisynthPluginInit2(IScriptEnvironment* env) {
-    env->AddFunction("TMaskCleaner", "c[length]i[thresh]i", Create_TMaskCleaner, 0);
+    env->AddFunction("TMaskCleaner", "c[length]i[thresh]i[apply]c[mode]i[lengths]s[cache]i[temporal]i[radius]i[hugepages]b[fast]i", Create_TMaskCleaner, 0);
+    env->AddFunction("TMaskCleanerCacheStats", "", Create_TMaskCleanerCacheStats, 0);
+    env->AddFunction("TMaskCleanerAllocStats", "", Create_TMaskCleanerAllocStats, 0);
     return "Why are you looking at this?";
 }